@@ -2,5 +2,7 @@
 
 dos2unix test_objects/*
 ./build/bin/test
+./build/bin/test_async
 unix2dos test_objects/*
 ./build/bin/test
+./build/bin/test_async
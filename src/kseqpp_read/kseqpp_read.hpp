@@ -4,9 +4,12 @@
 #include <algorithm>
 #include <cassert>
 #include <cctype>
+#include <cstddef>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <ios>
+#include <limits>
 #include <stdexcept>
 #include <string>
 #include <vector>
@@ -18,6 +21,31 @@ using std::vector;
 using size_t = uint64_t;
 
 const size_t DEFAULT_BUFSIZE = 16ULL * 1024;
+const size_t DEFAULT_PHRED_OFFSET = 33;
+// load_buf may return this when it has no data yet but is not at the end of
+// the file, see KStream::operator>>
+const int LOAD_BUF_WOULD_BLOCK = -2;
+
+/*
+ * Quality driven rewriting of FASTQ bases, applied while the quality string is
+ * scanned. All cutoffs are Phred scores and a cutoff of 0 disables that step.
+ * If trim_window is 0 or 1, the tail is trimmed while bases are below
+ * trim_cutoff, otherwise the read is cut at the start of the first window whose
+ * mean quality is below trim_cutoff. Bases which are still kept and are below
+ * mask_cutoff are then replaced with mask_char.
+ */
+class QualityPolicy {
+public:
+  size_t trim_cutoff = 0;
+  size_t trim_window = 0;
+  size_t mask_cutoff = 0;
+  char mask_char = 'N';
+  size_t phred_offset = DEFAULT_PHRED_OFFSET;
+
+  [[nodiscard]] inline auto is_active() const -> bool {
+    return trim_cutoff > 0 || mask_cutoff > 0;
+  }
+};
 
 class Seq {  // kseq_t
 public:
@@ -83,6 +111,22 @@ private:
     SPACE = 0,  // isspace(): \t, \n, \v, \f, \r
     LINE = 2    // line separator: "\n" (Unix) or "\r\n" (Windows)
   };
+  /* Where operator>> continues from, so that it can stop wherever load_buf
+   * would block */
+  enum class Phase {
+    BATCH,       // between sequences or at the start of a batch
+    HEADER,      // skipping the header line
+    LINE_START,  // start of a sequence line
+    LINE_END,    // after the characters of a sequence line
+    NEXT_LINE,   // skipping the newline of a sequence line
+    SEQ_END,     // checking whether the sequence continues on the next line
+    PLUS_LINE,   // skipping the '+' line of a FASTQ record
+    QUALS,       // reading the quality string
+    QUALS_END,   // skipping the newline of the last quality line
+    HELD,        // handing out a read which was held for its qualities
+    LOOKAHEAD,   // checking for the end of the file after a sequence
+    PEEK         // a LOOKAHEAD deferred to the start of the next batch
+  };
   /* Data members */
   Seq *rec;
   char *buf;
@@ -92,8 +136,18 @@ private:
   size_t current_seq_size = 0;
   bool eof = false;
   bool finished_reading_seq = true;
+  bool blocked = false;
+  Phase phase = Phase::BATCH;
+  size_t initial_rec_size = 0;
+  size_t quals_read = 0;
   char next_char = 0;
   size_t qual_size;
+  QualityPolicy quality_policy;
+  vector<char> quals;
+  // With a quality policy, the bases of the current read are kept here until
+  // its qualities are applied, so that no part of it is handed out untrimmed
+  vector<char> held_seq;
+  size_t held_released = 0;
   TFile file_handle;
   TFunc load_buf;
   close_type close_func;
@@ -132,86 +186,298 @@ public:
     if (this->close_func != nullptr) { this->close_func(this->file_handle); }
   }
 
+  inline auto set_quality_policy(const QualityPolicy &policy) -> void {
+    this->quality_policy = policy;
+  }
+
+  [[nodiscard]] inline auto is_blocked() const -> bool {
+    return this->blocked;
+  }
+
+  // If load_buf returns LOAD_BUF_WOULD_BLOCK, this returns false with
+  // is_blocked() set. It should then be called again with the same rec once
+  // more data is available, and continues from where it stopped.
   inline auto operator>>(Seq &rec_) -> bool {
     rec = &rec_;
-    size_t initial_rec_size
-      = rec->seqs.size() + rec->chars_before_new_seq.size();
-    while (
-      !(this->eof || this->rec->seqs.size() == rec->max_chars
-        || this->rec->chars_before_new_seq.size() == rec->max_seqs)
-    ) {
-      // skip header
-      if (this->finished_reading_seq) {
-        this->current_seq_size = 0;
-        this->finished_reading_seq = false;
-        skip_to_next_line();
-      }
-
-      // populate seq
-      read_seq();
-      peek_next_char();
-      if (!this->finished_reading_seq) { return true; }
-      if (this->eof) { break; }
+    if (!this->blocked) {
+      this->initial_rec_size
+        = rec->seqs.size() + rec->chars_before_new_seq.size();
     }
+    this->blocked = false;
+    parse();
+    if (this->blocked) { return false; }
     return rec->seqs.size() + rec->chars_before_new_seq.size()
-      > initial_rec_size;
+      > this->initial_rec_size;
   }
 
-  inline auto read_seq() -> void {
+  // Runs until the batch is complete or load_buf would block
+  inline auto parse() -> void {
     char c = 0;
-    // for each line
-    while (rec->seqs.size() != rec->max_chars) {
-      // check if this lines starts with a shit character
-      c = peek_next_char();
-      if (this->eof || c == '+' || c == '>' || c == '@') {
-        rec->chars_before_new_seq.push_back(rec->seqs.size());
-        this->finished_reading_seq = true;
-        return;
+    while (true) {
+      switch (this->phase) {
+        case Phase::PEEK:
+          peek_next_char();
+          if (this->blocked) { return; }
+          this->phase = Phase::BATCH;
+          break;
+        case Phase::BATCH:
+          if (this->eof || is_rec_full()) { return; }
+          if (this->finished_reading_seq) {
+            this->current_seq_size = 0;
+            this->held_seq.clear();
+            this->finished_reading_seq = false;
+            this->phase = Phase::HEADER;
+          } else {
+            this->phase = Phase::LINE_START;
+          }
+          break;
+        case Phase::HEADER:
+          if (!skip_to_next_line()) { return; }
+          this->phase = Phase::LINE_START;
+          break;
+        case Phase::LINE_START:
+          if (rec->seqs.size() == rec->max_chars) {
+            this->phase = Phase::LOOKAHEAD;
+            break;
+          }
+          // check if this lines starts with a shit character
+          c = peek_next_char();
+          if (this->blocked) { return; }
+          if (this->eof || c == '+' || c == '>' || c == '@') {
+            end_seq();
+            break;
+          }
+          // 3 stopping conditions: buf_end, eof, max_chars, newline
+          fill_seq();
+          this->phase = Phase::LINE_END;
+          break;
+        case Phase::LINE_END:
+          c = peek_next_char();
+          if (this->blocked) {
+            defer_if_rec_full();
+            return;
+          }
+          this->phase
+            = c == '\r' || c == '\n' ? Phase::NEXT_LINE : Phase::SEQ_END;
+          break;
+        case Phase::NEXT_LINE:
+          if (!skip_to_next_line()) {
+            defer_if_rec_full();
+            return;
+          }
+          this->phase = Phase::SEQ_END;
+          break;
+        case Phase::SEQ_END:
+          c = peek_next_char();
+          if (this->blocked) {
+            defer_if_rec_full();
+            return;
+          }
+          if (c == '+') {
+            this->phase = Phase::PLUS_LINE;
+          } else if (this->eof || c == '@' || c == '>') {
+            end_seq();
+          } else {
+            this->phase = Phase::LINE_START;
+          }
+          break;
+        case Phase::PLUS_LINE:
+          if (!skip_to_next_line()) { return; }
+          this->quals_read = 0;
+          if (this->quality_policy.is_active()) {
+            this->quals.resize(this->current_seq_size);
+          }
+          this->phase = Phase::QUALS;
+          break;
+        case Phase::QUALS:
+          if (!read_quality_string()) { return; }
+          this->phase = Phase::QUALS_END;
+          break;
+        case Phase::QUALS_END:
+          if (!skip_to_next_line()) { return; }
+          if (this->quality_policy.is_active()) { apply_quality_policy(); }
+          end_seq();
+          break;
+        case Phase::HELD:
+          if (!release_held_seq()) { return; }
+          mark_seq_end();
+          break;
+        case Phase::LOOKAHEAD:
+          peek_next_char();
+          if (this->blocked) {
+            // the peek only decides whether this batch goes on, so if it is
+            // over anyway, leave the peek to the next batch
+            if (!this->finished_reading_seq || is_rec_full()) {
+              this->blocked = false;
+              this->phase = Phase::PEEK;
+            }
+            return;
+          }
+          this->phase = Phase::BATCH;
+          if (!this->finished_reading_seq || this->eof) { return; }
+          break;
       }
+    }
+  }
 
-      fill_seq();
-      // 3 stopping conditions: buf_end, eof, max_chars, newline
-      c = peek_next_char();
-      if (c == '\r' || c == '\n') {
-        skip_to_next_line();
-        c = peek_next_char();
-      }
+  [[nodiscard]] inline auto is_rec_full() const -> bool {
+    return rec->seqs.size() == rec->max_chars
+      || rec->chars_before_new_seq.size() == rec->max_seqs;
+  }
 
-      if (this->eof || c == '+' || c == '@' || c == '>') {
-        if (c == '+') {
-          skip_to_next_line();
-          read_quality_string();
-        }
-        rec->chars_before_new_seq.push_back(rec->seqs.size());
-        this->finished_reading_seq = true;
-        break;
-      }
+  // When rec is full of characters, finding the end of the sequence only
+  // decides whether it ends in this batch or at the start of the next, so a
+  // blocked search is left for the next batch. A held read never fills rec.
+  inline auto defer_if_rec_full() -> void {
+    if (rec->seqs.size() == rec->max_chars) { this->blocked = false; }
+  }
+
+  inline auto end_seq() -> void {
+    if (this->quality_policy.is_active()) {
+      this->held_released = 0;
+      this->phase = Phase::HELD;
+      return;
     }
+    mark_seq_end();
+  }
+
+  inline auto mark_seq_end() -> void {
+    rec->chars_before_new_seq.push_back(rec->seqs.size());
+    this->finished_reading_seq = true;
+    this->phase = Phase::LOOKAHEAD;
+  }
+
+  // Copy as much of held_seq into rec as fits, returns whether all of it did
+  inline auto release_held_seq() -> bool {
+    const size_t n = std::min(
+      rec->max_chars - rec->seqs.size(),
+      this->held_seq.size() - this->held_released
+    );
+    const auto begin = this->held_seq.begin()
+      + static_cast<std::ptrdiff_t>(this->held_released);
+    rec->seqs.insert(
+      rec->seqs.end(), begin, begin + static_cast<std::ptrdiff_t>(n)
+    );
+    this->held_released += n;
+    return this->held_released == this->held_seq.size();
   }
 
   inline auto fill_seq() {
-    size_t seq_start = rec->seqs.size();
+    const bool hold = this->quality_policy.is_active();
+    auto &seqs = hold ? this->held_seq : rec->seqs;
+    const size_t max_chars
+      = hold ? std::numeric_limits<size_t>::max() : rec->max_chars;
+    size_t seq_start = seqs.size();
     size_t seq_size = seq_start;
     size_t start = buf_begin;
     char c = 0;
     // NOLINTNEXTLINE (cppcoreguidelines-pro-bounds-pointer-arithmetic)
     while (this->buf_begin < buf_end && buf[this->buf_begin] != '\r'
-           && buf[this->buf_begin] != '\n' && seq_size < rec->max_chars) {
+           && buf[this->buf_begin] != '\n' && seq_size < max_chars) {
       ++this->buf_begin;
       ++seq_size;
     }
-    rec->seqs.resize(rec->seqs.size() + this->buf_begin - start);
+    seqs.resize(seqs.size() + this->buf_begin - start);
     // NOLINTNEXTLINE (cppcoreguidelines-pro-bounds-pointer-arithmetic)
-    std::copy(buf + start, buf + this->buf_begin, rec->seqs.data() + seq_start);
+    std::copy(buf + start, buf + this->buf_begin, seqs.data() + seq_start);
     this->current_seq_size += this->buf_begin - start;
   }
 
-  inline auto read_quality_string() { read_n_chars(this->current_seq_size); }
+  // Returns false if load_buf would block before the end of the string
+  inline auto read_quality_string() -> bool {
+    if (!this->quality_policy.is_active()) {
+      return read_n_chars(this->current_seq_size);
+    }
+    return read_quals(this->current_seq_size);
+  }
+
+  // Copy the next n quality characters into quals, line by line
+  inline auto read_quals(size_t n) -> bool {
+    while (this->quals_read < n) {
+      char c = peek_next_char();
+      if (this->blocked) { return false; }
+      if (this->eof) { break; }
+      if (c == '\r' || c == '\n') {
+        ++this->buf_begin;
+        continue;
+      }
+      size_t start = this->buf_begin;
+      size_t end
+        = start + std::min(n - this->quals_read, this->buf_end - start);
+      // NOLINTNEXTLINE (cppcoreguidelines-pro-bounds-pointer-arithmetic)
+      char *line_end = std::find(buf + start, buf + end, '\n');
+      // NOLINTNEXTLINE (cppcoreguidelines-pro-bounds-pointer-arithmetic)
+      line_end = std::find(buf + start, line_end, '\r');
+      // NOLINTNEXTLINE (cppcoreguidelines-pro-bounds-pointer-arithmetic)
+      std::copy(buf + start, line_end, this->quals.data() + this->quals_read);
+      this->buf_begin = line_end - buf;
+      this->quals_read += this->buf_begin - start;
+    }
+    // missing qualities of a truncated record count as Phred 0
+    std::fill(
+      this->quals.begin() + static_cast<std::ptrdiff_t>(this->quals_read),
+      this->quals.end(),
+      static_cast<char>(this->quality_policy.phred_offset)
+    );
+    return true;
+  }
+
+  // Returns how many bases from the start of the read are kept
+  [[nodiscard]] inline auto get_trimmed_size() const -> size_t {
+    const auto &policy = this->quality_policy;
+    const size_t n = this->quals.size();
+    if (policy.trim_cutoff == 0) { return n; }
+    const auto *q = reinterpret_cast<const unsigned char *>(this->quals.data());
+    if (policy.trim_window <= 1) {
+      const size_t cutoff = policy.phred_offset + policy.trim_cutoff;
+      size_t kept = n;
+      // NOLINTNEXTLINE (cppcoreguidelines-pro-bounds-pointer-arithmetic)
+      while (kept > 0 && q[kept - 1] < cutoff) { --kept; }
+      return kept;
+    }
+    const size_t window = std::min(policy.trim_window, n);
+    const size_t cutoff = (policy.phred_offset + policy.trim_cutoff) * window;
+    size_t window_sum = 0;
+    // NOLINTNEXTLINE (cppcoreguidelines-pro-bounds-pointer-arithmetic)
+    for (size_t i = 0; i < window; ++i) { window_sum += q[i]; }
+    for (size_t i = 0; i + window <= n; ++i) {
+      if (window_sum < cutoff) { return i; }
+      if (i + window < n) {
+        // NOLINTNEXTLINE (cppcoreguidelines-pro-bounds-pointer-arithmetic)
+        window_sum = window_sum + q[i + window] - q[i];
+      }
+    }
+    return n;
+  }
+
+  // Trim and mask the held bases of the current read
+  inline auto apply_quality_policy() -> void {
+    const auto &policy = this->quality_policy;
+    const size_t kept_size = get_trimmed_size();
+    this->held_seq.resize(kept_size);
+    if (policy.mask_cutoff == 0) { return; }
+    // qualities are at most 255, so a larger cutoff masks everything
+    const auto cutoff = static_cast<uint32_t>(
+      std::min<size_t>(policy.phred_offset + policy.mask_cutoff, 256)
+    );
+    // locals so that the stores to bases cannot alias them, which lets the
+    // branchless loop be auto vectorized
+    const char mask_char = policy.mask_char;
+    const auto *q = reinterpret_cast<const unsigned char *>(this->quals.data());
+    char *bases = this->held_seq.data();
+    for (size_t i = 0; i < kept_size; ++i) {
+      // NOLINTNEXTLINE (cppcoreguidelines-pro-bounds-pointer-arithmetic)
+      const char base = bases[i];
+      // NOLINTNEXTLINE (cppcoreguidelines-pro-bounds-pointer-arithmetic)
+      bases[i] = q[i] < cutoff ? mask_char : base;
+    }
+  }
 
   /* Low-level methods */
   inline auto getc() noexcept -> char {
     if (this->buf_begin >= this->buf_end) {
       this->fetch_buffer();
+      if (this->blocked) { return 0; }
       if (this->buf_end <= 0) { this->eof = true; }
       if (this->eof) { return 0; }
     }
@@ -220,26 +486,44 @@ public:
 
   inline auto peek_next_char() noexcept -> char {
     char c = getc();
-    --buf_begin;
+    if (!this->blocked && !this->eof) { --buf_begin; }
     return c;
   }
 
   inline auto fetch_buffer() noexcept -> void {
     this->buf_begin = 0;
-    this->buf_end = this->load_buf(this->file_handle, this->buf, this->bufsize);
+    auto loaded = this->load_buf(this->file_handle, this->buf, this->bufsize);
+    this->blocked = loaded == LOAD_BUF_WOULD_BLOCK;
+    this->buf_end = this->blocked ? 0 : loaded;
   }
 
-  inline auto skip_to_next_line() -> void {
+  // Returns false if load_buf would block before the newline
+  inline auto skip_to_next_line() -> bool {
     // stop once you find a newline, next getc() will be the next char
-    while (!this->eof && getc() != '\n') {}
+    while (!this->eof) {
+      char c = getc();
+      if (this->blocked) { return false; }
+      if (c == '\n') { break; }
+    }
+    return true;
   }
 
-  inline auto read_n_chars(size_t n) -> void {
-    char c = 0;
-    for (size_t i = 0; i < n && (c = getc()); ++i) {
-      while (c == '\r' || c == '\n') { c = getc(); }
+  // Skip n characters which are not newlines, returns false if load_buf would
+  // block before then
+  inline auto read_n_chars(size_t n) -> bool {
+    // counted in a local, as this runs for every quality character
+    size_t chars_read = this->quals_read;
+    while (chars_read < n) {
+      char c = getc();
+      if (this->blocked) {
+        this->quals_read = chars_read;
+        return false;
+      }
+      if (c == 0) { break; }
+      if (c != '\r' && c != '\n') { ++chars_read; }
     }
-    skip_to_next_line();
+    this->quals_read = chars_read;
+    return true;
   }
 
   inline auto get_next_char() -> char {
@@ -0,0 +1,349 @@
+#ifndef KSEQPP_READ_ASYNC_HPP
+#define KSEQPP_READ_ASYNC_HPP
+
+#if __cplusplus < 202002L
+#error "kseqpp_read_async.hpp requires C++20"
+#endif
+
+#include <atomic>
+#include <cerrno>
+#include <coroutine>
+#include <exception>
+#include <mutex>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "kseqpp_read.hpp"
+
+namespace reklibpp {
+
+class EventLoop;
+
+/*
+ * A coroutine which is started by EventLoop::spawn and destroys itself once
+ * it finishes
+ */
+class Task {
+public:
+  class promise_type {
+  public:
+    EventLoop *loop = nullptr;
+
+    auto get_return_object() -> Task {
+      return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    auto initial_suspend() noexcept -> std::suspend_always { return {}; }
+    auto final_suspend() noexcept -> std::suspend_never;
+    auto return_void() noexcept -> void {}
+    auto unhandled_exception() noexcept -> void;
+  };
+
+  Task(Task &) = delete;
+  Task(Task &&other) noexcept: handle(std::exchange(other.handle, nullptr)) {}
+  auto operator=(Task &) = delete;
+  auto operator=(Task &&) = delete;
+
+  ~Task() noexcept {
+    if (handle) { handle.destroy(); }
+  }
+
+private:
+  friend class EventLoop;
+  explicit Task(std::coroutine_handle<promise_type> handle_): handle(handle_) {}
+  std::coroutine_handle<promise_type> handle;
+};
+
+/*
+ * Epoll based event loop. Tasks are spawned onto it, and run() may be called
+ * from several threads at once to share the tasks between them. run() keeps
+ * going while there is nothing to do, until stop() is called and all tasks
+ * have finished.
+ */
+class EventLoop {
+public:
+  // Notified once when the fd it is watching becomes readable
+  class Watcher {
+  public:
+    virtual auto on_ready() -> void = 0;
+
+  protected:
+    ~Watcher() = default;
+  };
+
+private:
+  int epoll_fd;
+  int stop_fd;
+  std::atomic<size_t> active_tasks = 0;
+  std::atomic<bool> stop_requested = false;
+  std::mutex exception_mutex;
+  std::exception_ptr exception;
+
+public:
+  EventLoop():
+      epoll_fd(epoll_create1(EPOLL_CLOEXEC)),
+      stop_fd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) {
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+    if (epoll_fd < 0 || stop_fd < 0
+        || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_fd, &event) < 0) {
+      int error = errno;
+      close(this->stop_fd);
+      close(this->epoll_fd);
+      throw std::system_error(error, std::generic_category(), "EventLoop");
+    }
+  }
+
+  EventLoop(EventLoop &) = delete;
+  EventLoop(EventLoop &&other) = delete;
+  auto operator=(EventLoop &) = delete;
+  auto operator=(EventLoop &&) = delete;
+
+  ~EventLoop() noexcept {
+    close(this->stop_fd);
+    close(this->epoll_fd);
+  }
+
+  // Starts the task on the calling thread until it first suspends. Once stop()
+  // has been called, only running tasks may spawn more tasks.
+  inline auto spawn(Task task) -> void {
+    ++this->active_tasks;
+    auto handle = std::exchange(task.handle, nullptr);
+    handle.promise().loop = this;
+    handle.resume();
+  }
+
+  // Makes run() return in every thread once all tasks have finished
+  inline auto stop() -> void {
+    this->stop_requested = true;
+    if (this->active_tasks == 0) { signal_stop(); }
+  }
+
+  // Arms a one shot notification for when fd becomes readable
+  inline auto watch(int fd, Watcher *watcher, bool first_watch) -> void {
+    epoll_event event{};
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = watcher;
+    if (epoll_ctl(
+          this->epoll_fd,
+          first_watch ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+          fd,
+          &event
+        )
+        < 0) {
+      throw std::system_error(errno, std::generic_category(), "epoll_ctl");
+    }
+  }
+
+  // Called from destructors, where a failure can only be ignored
+  inline auto unwatch(int fd) noexcept -> void {
+    epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+  }
+
+  inline auto run() -> void {
+    const int max_events = 64;
+    std::vector<epoll_event> events(max_events);
+    bool stopping = false;
+    while (!stopping) {
+      int n = epoll_wait(this->epoll_fd, events.data(), max_events, -1);
+      if (n < 0) {
+        if (errno == EINTR) { continue; }
+        throw std::system_error(errno, std::generic_category(), "epoll_wait");
+      }
+      for (int i = 0; i < n; ++i) {
+        auto *watcher = static_cast<Watcher *>(events[i].data.ptr);
+        if (watcher == nullptr) {
+          // stop_fd is never read, so it wakes up every thread
+          stopping = true;
+        } else {
+          watcher->on_ready();
+        }
+      }
+    }
+    std::lock_guard lock(this->exception_mutex);
+    if (this->exception) { std::rethrow_exception(this->exception); }
+  }
+
+private:
+  friend class Task::promise_type;
+
+  inline auto signal_stop() noexcept -> void {
+    eventfd_write(this->stop_fd, 1);
+  }
+
+  inline auto task_done() noexcept -> void {
+    // either this or stop() sees the other's write, so one of them signals
+    if (--this->active_tasks == 0 && this->stop_requested) { signal_stop(); }
+  }
+
+  inline auto set_exception(std::exception_ptr e) noexcept -> void {
+    std::lock_guard lock(this->exception_mutex);
+    if (!this->exception) { this->exception = std::move(e); }
+  }
+};
+
+inline auto Task::promise_type::final_suspend() noexcept
+  -> std::suspend_never {
+  this->loop->task_done();
+  return {};
+}
+
+inline auto Task::promise_type::unhandled_exception() noexcept -> void {
+  this->loop->set_exception(std::current_exception());
+}
+
+/*
+ * The file handle of the KStream within AsyncSeqStreamIn, a non-blocking fd
+ */
+class FdSource {
+public:
+  int fd;
+  int error = 0;
+
+  explicit FdSource(int fd_): fd(fd_) {}
+
+  // load_buf of the KStream, read errors are kept and count as the end of the
+  // file
+  static auto load(FdSource *source, void *buf, unsigned int bufsize) -> int {
+    while (true) {
+      ssize_t n = ::read(source->fd, buf, bufsize);
+      if (n >= 0) { return static_cast<int>(n); }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return LOAD_BUF_WOULD_BLOCK;
+      }
+      if (errno != EINTR) {
+        source->error = errno;
+        return 0;
+      }
+    }
+  }
+};
+
+/*
+ * Reads sequences from a pipe or socket without blocking, for use within a
+ * Task. The KStream reads straight from the fd, and when the fd has no data
+ * it stops where it is and the coroutine is suspended until the fd is
+ * readable, so each character is read and parsed once. Only plain (not
+ * gzipped) input is supported.
+ */
+class AsyncSeqStreamIn final: public EventLoop::Watcher {
+public:
+  using load_type = int (*)(FdSource *, void *, unsigned int);
+  class ReadAwaiter;
+
+private:
+  EventLoop &loop;
+  FdSource source;
+  KStream<FdSource *, load_type> stream;
+  bool first_watch = true;
+  ReadAwaiter *waiting = nullptr;
+  // Held while arming the fd and while handling its event, so that whatever
+  // the thread which armed it did is seen by the thread which gets the event
+  std::mutex handoff_mutex;
+
+public:
+  class ReadAwaiter final {
+  private:
+    friend class AsyncSeqStreamIn;
+    AsyncSeqStreamIn &iss;
+    Seq &rec;
+    std::coroutine_handle<> handle;
+    bool result = false;
+    std::exception_ptr exception;
+
+  public:
+    ReadAwaiter(AsyncSeqStreamIn &iss_, Seq &rec_): iss(iss_), rec(rec_) {}
+
+    auto await_ready() -> bool { return try_complete(); }
+
+    auto await_suspend(std::coroutine_handle<> handle_) -> void {
+      std::lock_guard lock(this->iss.handoff_mutex);
+      this->handle = handle_;
+      this->iss.waiting = this;
+      this->iss.watch();
+    }
+
+    auto await_resume() -> bool {
+      if (this->exception) { std::rethrow_exception(this->exception); }
+      if (this->iss.source.error != 0) {
+        throw std::system_error(
+          this->iss.source.error, std::generic_category(), "AsyncSeqStreamIn"
+        );
+      }
+      return this->result;
+    }
+
+  private:
+    auto try_complete() -> bool {
+      this->result = this->iss.stream >> this->rec;
+      return !this->iss.stream.is_blocked();
+    }
+  };
+
+  AsyncSeqStreamIn(
+    EventLoop &loop_, int fd, const size_t bufsize = DEFAULT_BUFSIZE
+  ):
+      loop(loop_), source(fd), stream(&source, FdSource::load, bufsize) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+      int error = errno;
+      close(fd);
+      throw std::system_error(error, std::generic_category(), "fcntl");
+    }
+  }
+
+  AsyncSeqStreamIn(AsyncSeqStreamIn &) = delete;
+  AsyncSeqStreamIn(AsyncSeqStreamIn &&other) = delete;
+  auto operator=(AsyncSeqStreamIn &) = delete;
+  auto operator=(AsyncSeqStreamIn &&) = delete;
+
+  ~AsyncSeqStreamIn() noexcept {
+    if (!this->first_watch) { this->loop.unwatch(this->source.fd); }
+    close(this->source.fd);
+  }
+
+  inline auto set_quality_policy(const QualityPolicy &policy) -> void {
+    this->stream.set_quality_policy(policy);
+  }
+
+  // co_await iss.read(record) behaves like iss >> record on SeqStreamIn
+  [[nodiscard]] inline auto read(Seq &rec) -> ReadAwaiter {
+    return {*this, rec};
+  }
+
+  // Nothing may be accessed after resuming or after unlocking once re-armed,
+  // as this stream may then be destroyed or notified on another thread
+  auto on_ready() -> void override {
+    std::unique_lock lock(this->handoff_mutex);
+    auto *awaiter = std::exchange(this->waiting, nullptr);
+    // any exception is handed to the coroutine, so that its task still ends
+    try {
+      if (!awaiter->try_complete()) {
+        this->waiting = awaiter;
+        this->watch();
+        return;
+      }
+    } catch (...) {
+      this->waiting = nullptr;
+      awaiter->exception = std::current_exception();
+    }
+    lock.unlock();
+    awaiter->handle.resume();
+  }
+
+private:
+  auto watch() -> void {
+    this->loop.watch(
+      this->source.fd, this, std::exchange(this->first_watch, false)
+    );
+  }
+};
+
+}  // namespace reklibpp
+#endif
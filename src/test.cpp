@@ -4,6 +4,7 @@
 #include <gtest/gtest.h>
 
 #include "kseqpp_read.hpp"
+#include "test_utils.hpp"
 
 namespace reklibpp {
 
@@ -67,26 +68,11 @@ public:
   }
 };
 
-auto get_seqs(
-  const string &filename,
-  const size_t max_chars,
-  const size_t max_seqs = DEFAULT_BUFSIZE / 100,
-  const size_t file_bufsize = DEFAULT_BUFSIZE
-) -> vector<Seq> {
-  vector<Seq> ret;
-  Seq record(max_chars, max_seqs);
-  SeqStreamIn iss(filename.c_str(), file_bufsize);
-  while (iss >> record) {
-    ret.push_back(record);
-    record.clear();
-  }
-  return ret;
-}
-
 class Test: public ::testing::Test {
 public:
   string fasta_file = "test_objects/queries.fna";
   string fastq_file = "test_objects/queries.fnq";
+  string low_quality_file = "test_objects/low_quality.fnq";
   vector<Seq> small_expected = {
     {"1ACTGCAATGGGCAAT", {}},
     {"ATGTCTCTGTGTGGAT", {}},
@@ -126,17 +112,18 @@ public:
     {"1ACTGCAATGGGCAATATGTCTCTGTGTGGATTAC23TCTAGCTACTACTACTGATGGATGGAATGTGATG4",
      {36, 72}},
     {"5TGAGTGAGATGAGGTGATAGTGACGTAGTGAGGA6", {36}}};
+  vector<Seq> threshold_trimmed_expected = {{"ACGTACGTGGGGTTTT", {8, 12, 16}}};
+  vector<Seq> window_trimmed_expected = {{"ACGGGGTTTT", {2, 6, 10}}};
+  vector<Seq> masked_expected
+    = {{"ACNNACGTNNGGGGNNNNTTTT", {10, 18, 22}}};
+  vector<Seq> trimmed_and_masked_expected = {{"ACNNACGTGGGGTTTT", {8, 12, 16}}};
+  vector<Seq> small_threshold_trimmed_expected = {
+    {"ACGTAC", {}},
+    {"GTGGGG", {2, 6}},
+    {"TTTT", {4}},
+  };
 };
 
-auto assert_seqs_equal(const vector<Seq> &seqs1, const vector<Seq> &seqs2)
-  -> void {
-  for (size_t i = 0; i < seqs1.size(); ++i) {
-    EXPECT_EQ(seqs1[i].chars_before_new_seq, seqs2[i].chars_before_new_seq)
-      << "differs at index " << i;
-    EXPECT_EQ(seqs1[i].seqs, seqs2[i].seqs) << "differs at index " << i;
-  }
-}
-
 TEST_F(Test, TestFASTASmallBufferFASTA) {
   KseqppFullReader(fasta_file, 16).assert_correct();
   assert_seqs_equal(get_seqs(fasta_file, 16), small_expected);
@@ -230,4 +217,95 @@ TEST_F(Test, TestLimitedMaxReadsDouble) {
   assert_seqs_equal(get_seqs(fasta_file, 9999, 2), double_expected);
 }
 
+TEST_F(Test, TestQualityNoPolicy) {
+  assert_seqs_equal(
+    get_seqs(low_quality_file, 9999),
+    {{"ACGTACGTACGGGGCCCCTTTT", {10, 18, 22}}}
+  );
+}
+
+TEST_F(Test, TestQualityThresholdTrim) {
+  QualityPolicy policy;
+  policy.trim_cutoff = 20;
+  assert_seqs_equal(
+    get_seqs(low_quality_file, 9999, 999, DEFAULT_BUFSIZE, policy),
+    threshold_trimmed_expected
+  );
+}
+
+TEST_F(Test, TestQualityWindowTrim) {
+  QualityPolicy policy;
+  policy.trim_cutoff = 20;
+  policy.trim_window = 2;
+  assert_seqs_equal(
+    get_seqs(low_quality_file, 9999, 999, DEFAULT_BUFSIZE, policy),
+    window_trimmed_expected
+  );
+}
+
+TEST_F(Test, TestQualityMask) {
+  QualityPolicy policy;
+  policy.mask_cutoff = 20;
+  assert_seqs_equal(
+    get_seqs(low_quality_file, 9999, 999, DEFAULT_BUFSIZE, policy),
+    masked_expected
+  );
+}
+
+TEST_F(Test, TestQualityTrimAndMask) {
+  QualityPolicy policy;
+  policy.trim_cutoff = 20;
+  policy.mask_cutoff = 20;
+  assert_seqs_equal(
+    get_seqs(low_quality_file, 9999, 999, DEFAULT_BUFSIZE, policy),
+    trimmed_and_masked_expected
+  );
+}
+
+TEST_F(Test, TestQualityMaskLargeCutoff) {
+  QualityPolicy policy;
+  policy.mask_cutoff = 300;
+  assert_seqs_equal(
+    get_seqs(low_quality_file, 9999, 999, DEFAULT_BUFSIZE, policy),
+    {{"NNNNNNNNNNNNNNNNNNNNNN", {10, 18, 22}}}
+  );
+}
+
+TEST_F(Test, TestQualityMaskSmallFileBuffer) {
+  QualityPolicy policy;
+  policy.mask_cutoff = 20;
+  assert_seqs_equal(
+    get_seqs(low_quality_file, 9999, 999, 5, policy), masked_expected
+  );
+}
+
+TEST_F(Test, TestQualityThresholdTrimSmallBuffer) {
+  QualityPolicy policy;
+  policy.trim_cutoff = 20;
+  assert_seqs_equal(
+    get_seqs(low_quality_file, 6, 999, DEFAULT_BUFSIZE, policy),
+    small_threshold_trimmed_expected
+  );
+}
+
+TEST_F(Test, TestQualityTrimAndMaskSmallBuffer) {
+  QualityPolicy policy;
+  policy.trim_cutoff = 20;
+  policy.mask_cutoff = 20;
+  assert_seqs_equal(
+    get_seqs(low_quality_file, 6, 999, DEFAULT_BUFSIZE, policy),
+    {{"ACNNAC", {}}, {"GTGGGG", {2, 6}}, {"TTTT", {4}}}
+  );
+}
+
+TEST_F(Test, TestQualityPolicyKeepsFASTQ) {
+  QualityPolicy policy;
+  policy.trim_cutoff = 20;
+  policy.trim_window = 4;
+  policy.mask_cutoff = 20;
+  assert_seqs_equal(
+    get_seqs(fastq_file, 9999, 999, DEFAULT_BUFSIZE, policy), full_expected
+  );
+}
+
 }  // namespace reklibpp
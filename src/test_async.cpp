@@ -0,0 +1,229 @@
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <sys/socket.h>
+
+#include "kseqpp_read_async.hpp"
+#include "test_utils.hpp"
+
+namespace reklibpp {
+
+using std::string;
+using std::vector;
+
+auto read_file(const string &filename) -> string {
+  std::ifstream stream(filename, std::ios::binary);
+  std::stringstream ss;
+  ss << stream.rdbuf();
+  return ss.str();
+}
+
+// The sequences within the batches, as the batches themselves may differ if
+// a batch is given out before the end of its last sequence has been seen
+auto to_strings(const vector<Seq> &batches) -> vector<string> {
+  vector<string> strings = {""};
+  for (const auto &batch : batches) {
+    size_t seq_start = 0;
+    for (auto str_break : batch.chars_before_new_seq) {
+      strings.back().append(
+        batch.seqs.begin() + static_cast<std::ptrdiff_t>(seq_start),
+        batch.seqs.begin() + static_cast<std::ptrdiff_t>(str_break)
+      );
+      strings.emplace_back("");
+      seq_start = str_break;
+    }
+    strings.back().append(
+      batch.seqs.begin() + static_cast<std::ptrdiff_t>(seq_start),
+      batch.seqs.end()
+    );
+  }
+  return strings;
+}
+
+auto get_seqs_async(
+  EventLoop &loop,
+  int fd,
+  const size_t max_chars,
+  const size_t file_bufsize,
+  vector<Seq> &out,
+  QualityPolicy quality_policy = QualityPolicy()
+) -> Task {
+  AsyncSeqStreamIn iss(loop, fd, file_bufsize);
+  iss.set_quality_policy(quality_policy);
+  Seq record(max_chars);
+  while (co_await iss.read(record)) {
+    out.push_back(record);
+    record.clear();
+  }
+}
+
+// Writes contents to fd a few characters at a time, then closes it
+auto write_slowly(int fd, const string &contents, size_t chunk_size) -> void {
+  for (size_t i = 0; i < contents.size(); i += chunk_size) {
+    size_t n = std::min(chunk_size, contents.size() - i);
+    ASSERT_EQ(write(fd, contents.data() + i, n), static_cast<ssize_t>(n));
+    std::this_thread::yield();
+  }
+  close(fd);
+}
+
+auto start_loop(EventLoop &loop, size_t threads) -> vector<std::thread> {
+  vector<std::thread> pool;
+  for (size_t i = 0; i < threads; ++i) {
+    pool.emplace_back([&loop] { loop.run(); });
+  }
+  return pool;
+}
+
+auto join(vector<std::thread> &threads) -> void {
+  for (auto &thread : threads) { thread.join(); }
+}
+
+class AsyncTest: public ::testing::Test {
+public:
+  vector<string> files = {
+    "test_objects/queries.fna",
+    "test_objects/queries.fnq",
+    "test_objects/fasta_empty_line.fna",
+    "test_objects/low_quality.fnq"};
+  vector<size_t> max_chars = {6, 16, 36, 54, 9999};
+
+  // Spawns a reader for each file and max_chars, and checks them against
+  // SeqStreamIn once they are done
+  auto test_many_pipes(bool spawn_while_running) -> void {
+    EventLoop loop;
+    vector<std::thread> pool;
+    if (spawn_while_running) { pool = start_loop(loop, 3); }
+    vector<std::thread> writers;
+    vector<vector<Seq>> results(files.size() * max_chars.size());
+    for (size_t f = 0; f < files.size(); ++f) {
+      const string contents = read_file(files[f]);
+      for (size_t m = 0; m < max_chars.size(); ++m) {
+        std::array<int, 2> fds{};
+        ASSERT_EQ(pipe(fds.data()), 0);
+        writers.emplace_back(write_slowly, fds[1], contents, 1 + (f + m) % 7);
+        loop.spawn(get_seqs_async(
+          loop, fds[0], max_chars[m], 5, results[f * max_chars.size() + m]
+        ));
+      }
+    }
+    loop.stop();
+    if (!spawn_while_running) { pool = start_loop(loop, 3); }
+    join(pool);
+    join(writers);
+    for (size_t f = 0; f < files.size(); ++f) {
+      for (size_t m = 0; m < max_chars.size(); ++m) {
+        EXPECT_EQ(
+          to_strings(results[f * max_chars.size() + m]),
+          to_strings(get_seqs(files[f], max_chars[m]))
+        ) << files[f] << " with max_chars " << max_chars[m];
+      }
+    }
+  }
+};
+
+TEST_F(AsyncTest, TestManyPipes) { test_many_pipes(false); }
+
+TEST_F(AsyncTest, TestSpawnWhileRunning) { test_many_pipes(true); }
+
+TEST_F(AsyncTest, TestSocketWithQualityPolicy) {
+  EventLoop loop;
+  QualityPolicy policy;
+  policy.trim_cutoff = 20;
+  policy.mask_cutoff = 20;
+  vector<Seq> result;
+  std::array<int, 2> fds{};
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds.data()), 0);
+  std::thread writer(
+    write_slowly, fds[1], read_file("test_objects/low_quality.fnq"), 3
+  );
+  loop.spawn(get_seqs_async(loop, fds[0], 9999, 64, result, policy));
+  loop.stop();
+  loop.run();
+  writer.join();
+  assert_seqs_equal(
+    result,
+    get_seqs(
+      "test_objects/low_quality.fnq", 9999, DEFAULT_BUFSIZE / 100, 64, policy
+    )
+  );
+}
+
+TEST_F(AsyncTest, TestEmptyStream) {
+  EventLoop loop;
+  vector<Seq> result;
+  std::array<int, 2> fds{};
+  ASSERT_EQ(pipe(fds.data()), 0);
+  close(fds[1]);
+  loop.spawn(get_seqs_async(loop, fds[0], 9999, 64, result));
+  loop.stop();
+  loop.run();
+  assert_seqs_equal(result, get_seqs("/dev/null", 9999));
+}
+
+TEST_F(AsyncTest, TestReadError) {
+  EventLoop loop;
+  vector<Seq> result;
+  // reading a directory fails with EISDIR
+  int fd = open("test_objects", O_RDONLY | O_DIRECTORY);
+  ASSERT_GE(fd, 0);
+  loop.spawn(get_seqs_async(loop, fd, 9999, 64, result));
+  loop.stop();
+  EXPECT_THROW(loop.run(), std::system_error);
+}
+
+// A batch which is complete must be given out without waiting for the next
+// character, as the sender may be waiting for a reply before sending it
+auto read_one_batch(
+  EventLoop &loop,
+  int fd,
+  Seq &out,
+  std::atomic<bool> &done
+) -> Task {
+  AsyncSeqStreamIn iss(loop, fd);
+  co_await iss.read(out);
+  done = true;
+}
+
+auto test_batch_without_lookahead(
+  const string &contents, size_t max_chars, size_t max_seqs, const Seq &expected
+) -> void {
+  EventLoop loop;
+  auto pool = start_loop(loop, 1);
+  std::array<int, 2> fds{};
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds.data()), 0);
+  ASSERT_EQ(
+    write(fds[1], contents.data(), contents.size()),
+    static_cast<ssize_t>(contents.size())
+  );
+  Seq result(max_chars, max_seqs);
+  std::atomic<bool> done = false;
+  loop.spawn(read_one_batch(loop, fds[0], result, done));
+  loop.stop();
+  // wait for the batch before closing the socket, and give up eventually
+  for (int i = 0; i < 500 && !done; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  const bool done_before_close = done;
+  close(fds[1]);
+  join(pool);
+  EXPECT_TRUE(done_before_close);
+  assert_seqs_equal({result}, {expected});
+}
+
+TEST_F(AsyncTest, TestFullSeqsBatchWithoutLookahead) {
+  test_batch_without_lookahead("@r1\nACGT\n+\nIIII\n", 9999, 1, {"ACGT", {4}});
+}
+
+TEST_F(AsyncTest, TestFullCharsBatchWithoutLookahead) {
+  test_batch_without_lookahead(">r1\nACGTAC", 6, 9999, {"ACGTAC", {}});
+}
+
+}  // namespace reklibpp
@@ -0,0 +1,43 @@
+#ifndef TEST_UTILS_HPP
+#define TEST_UTILS_HPP
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "kseqpp_read.hpp"
+
+namespace reklibpp {
+
+inline auto get_seqs(
+  const std::string &filename,
+  const size_t max_chars,
+  const size_t max_seqs = DEFAULT_BUFSIZE / 100,
+  const size_t file_bufsize = DEFAULT_BUFSIZE,
+  const QualityPolicy &quality_policy = QualityPolicy()
+) -> std::vector<Seq> {
+  std::vector<Seq> ret;
+  Seq record(max_chars, max_seqs);
+  SeqStreamIn iss(filename.c_str(), file_bufsize);
+  iss.set_quality_policy(quality_policy);
+  while (iss >> record) {
+    ret.push_back(record);
+    record.clear();
+  }
+  return ret;
+}
+
+inline auto assert_seqs_equal(
+  const std::vector<Seq> &seqs1, const std::vector<Seq> &seqs2
+) -> void {
+  ASSERT_EQ(seqs1.size(), seqs2.size());
+  for (size_t i = 0; i < seqs1.size(); ++i) {
+    EXPECT_EQ(seqs1[i].chars_before_new_seq, seqs2[i].chars_before_new_seq)
+      << "differs at index " << i;
+    EXPECT_EQ(seqs1[i].seqs, seqs2[i].seqs) << "differs at index " << i;
+  }
+}
+
+}  // namespace reklibpp
+#endif